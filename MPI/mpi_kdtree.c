@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <time.h>
 #include <mpi.h>
 
@@ -43,6 +44,17 @@ struct kdnode
 // declare MPI datatype for comms as global variable
 MPI_Datatype MPI_kdnode_t;
 
+#ifdef KNN
+// a point is not its own neighbour, there are at most NPTS-1
+#if KNN >= NPTS
+#error "KNN must be smaller than NPTS"
+#endif
+
+// subtree grown serially by this process, nodes keep global indices
+kdnode_t *local_tree = NULL;
+int local_count = 0, local_offset = 0, local_root = -1;
+#endif
+
 // ==================================================================
 //                          User functions
 // ==================================================================
@@ -129,43 +141,44 @@ void swap(kdnode_t *a, kdnode_t *b)
 
 int findMedian(kdnode_t *data, int start, int end, int axis)
 {
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Hoare style quickselect. Both scans stop on
+     * points equal to the pivot, so runs of equal
+     * coordinates are spread on both sides and at
+     * the end nothing left of md is greater and
+     * nothing right of it is smaller
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
     if (end <= start)
         return -1;
     if (end == start + 1)
         return start;
 
-    int p, store;
     int md = start + (end - start) / 2;
-    double pivot;
+    int l = start, r = end - 1;
 
-    while (1)
+    while (l < r)
     {
         // take median as pivot
-        pivot = (data + md)->split[axis];
+        float_t pivot = (data + md)->split[axis];
 
-        // swap median with end
-        swap((data + md), (data + end - 1));
-
-        for (p = store = start; p < end; ++p)
+        int i = l, j = r;
+        do
         {
-            if ((data + p)->split[axis] < pivot)
-            {
-                if (p != store)
-                    swap((data + p), (data + store));
-                ++store;
-            }
-        }
-
-        swap((data + store), (data + end - 1));
-
-        if ((data + store)->split[axis] == (data + md)->split[axis])
-            return md;
-
-        if (store > md)
-            end = store;
-        else
-            start = store;
+            while ((data + i)->split[axis] < pivot)
+                ++i;
+            while (pivot < (data + j)->split[axis])
+                --j;
+            if (i <= j)
+                swap((data + i++), (data + j--));
+        } while (i <= j);
+
+        if (j < md)
+            l = i;
+        if (md < i)
+            r = j;
     }
+    return md;
 }
 
 void splitComms(MPI_Comm comm, MPI_Comm *new_comm)
@@ -219,7 +232,15 @@ int growTree(kdnode_t *tree, int start, int end, int offset, int axis, MPI_Comm
     // single process in communicator case
     if (comm_size <= 1)
     {
+#ifdef KNN
+        local_tree = tree + start;
+        local_count = end - start;
+        local_offset = offset + start;
+        local_root = growTreeSerial(tree, start, end, offset, axis);
+        return local_root;
+#else
         return growTreeSerial(tree, start, end, offset, axis);
+#endif
     }
 
     // parallel case
@@ -279,12 +300,272 @@ int growTree(kdnode_t *tree, int start, int end, int offset, int axis, MPI_Comm
         MPI_Send(&nright, 1, MPI_INT, 0, 11*comm_size, comm);
         // send reordered points
         MPI_Send(tree, right_count, MPI_kdnode_t, 0, 13*comm_size, comm);
+#ifdef KNN
+        // keep only the part grown here, at the start of the buffer,
+        // a failed shrink leaves the buffer as it is and still usable
+        local_tree = (kdnode_t *)realloc(tree, (local_count > 0 ? local_count : 1) * sizeof(kdnode_t));
+        if (local_tree == NULL) local_tree = tree;
+#else
         free(tree);
+#endif
     }
 
     return offset + md;
 }
 
+// ==================================================================
+//                          All-points kNN
+// ==================================================================
+#ifdef KNN
+double dist2(const float_t *a, const float_t *b)
+{
+    double d2 = 0.0;
+    for (int d = 0; d < NDIM; ++d)
+        d2 += ((double)a[d] - b[d]) * ((double)a[d] - b[d]);
+    return d2;
+}
+
+void heapSift(int *hidx, double *hd2)
+{
+    // restores the max-heap after the top has been replaced
+    int i = 0;
+    while (1)
+    {
+        int c = 2 * i + 1;
+        if (c >= KNN)
+            break;
+        if (c + 1 < KNN && hd2[c + 1] > hd2[c])
+            ++c;
+        if (hd2[c] <= hd2[i])
+            break;
+
+        int ti = hidx[i]; hidx[i] = hidx[c]; hidx[c] = ti;
+        double td = hd2[i]; hd2[i] = hd2[c]; hd2[c] = td;
+        i = c;
+    }
+}
+
+void knnSearch(kdnode_t *tree, int offset, int node, const float_t *q, int self,
+               int *hidx, double *hd2)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * k nearest neighbours of point self, the max-heap
+     * hidx/hd2 holds the candidates and its top is
+     * the current pruning radius. Node indices are
+     * global, tree holds them from offset on
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    if (node < 0)
+        return;
+
+    kdnode_t *nd = tree + node - offset;
+
+    double d2 = dist2(nd->split, q);
+    if (node != self && d2 < hd2[0])
+    {
+        hidx[0] = node;
+        hd2[0] = d2;
+        heapSift(hidx, hd2);
+    }
+
+    double diff = (double)q[nd->axis] - nd->split[nd->axis];
+    knnSearch(tree, offset, diff < 0 ? nd->left : nd->right, q, self, hidx, hd2);
+    if (diff * diff < hd2[0])
+        knnSearch(tree, offset, diff < 0 ? nd->right : nd->left, q, self, hidx, hd2);
+}
+
+double knnPoint(kdnode_t *tree, int offset, int root, int self, int *nbr, float_t *nbrd)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Stores the KNN neighbours of self by increasing
+     * distance and returns the distance of the
+     * farthest one, infinite if there are too few
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    int hidx[KNN];
+    double hd2[KNN];
+    for (int j = 0; j < KNN; ++j)
+    {
+        hidx[j] = -1;
+        hd2[j] = INFINITY;
+    }
+
+    knnSearch(tree, offset, root, (tree + self - offset)->split, self, hidx, hd2);
+    double radius = sqrt(hd2[0]);
+
+    // empty the heap from the farthest
+    for (int j = KNN - 1; j >= 0; --j)
+    {
+        nbr[j] = hidx[0];
+        nbrd[j] = sqrt(hd2[0]);
+        hidx[0] = -1;
+        hd2[0] = -1.0;
+        heapSift(hidx, hd2);
+    }
+    return radius;
+}
+
+int allKnnLocal(int root, int *nbr, float_t *nbrd, int *cross)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Neighbours of the points of the local subtree,
+     * searched in the local subtree only. Points whose
+     * k-th radius reaches the bounding box of the
+     * subtree may have closer points elsewhere: their
+     * global indices go in cross, and their count is
+     * returned
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    float_t lo[NDIM], hi[NDIM];
+    for (int d = 0; d < NDIM; ++d)
+        lo[d] = hi[d] = local_count ? local_tree->split[d] : 0;
+    for (int i = 1; i < local_count; ++i)
+    {
+        for (int d = 0; d < NDIM; ++d)
+        {
+            if ((local_tree + i)->split[d] < lo[d])
+                lo[d] = (local_tree + i)->split[d];
+            if ((local_tree + i)->split[d] > hi[d])
+                hi[d] = (local_tree + i)->split[d];
+        }
+    }
+
+    int ncross = 0;
+    for (int i = 0; i < local_count; ++i)
+    {
+        int self = local_offset + i;
+        double radius = knnPoint(local_tree, local_offset, root, self,
+                                 nbr + (size_t)KNN * i, nbrd + (size_t)KNN * i);
+
+        // a subtree holding every point has nothing outside
+        if (local_count == NPTS)
+            continue;
+
+        const float_t *q = (local_tree + i)->split;
+        for (int d = 0; d < NDIM; ++d)
+        {
+            if (q[d] - lo[d] <= radius || hi[d] - q[d] <= radius)
+            {
+                cross[ncross++] = self;
+                break;
+            }
+        }
+    }
+    return ncross;
+}
+
+void allKnnParallel(kdnode_t *tree, int root, int mpi_rank, int mpi_size,
+                    int **nbr, float_t **nbrd, MPI_Comm comm)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Every process answers the points of the subtree
+     * it grew, without copying any other data. Root
+     * gathers the answers and searches its full tree
+     * again for the points near a subtree boundary and
+     * for the medians of the parallel levels, which
+     * belong to no subtree
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    int *local_nbr = (int *)malloc(((size_t)local_count * KNN + 1) * sizeof(int));
+    float_t *local_nbrd = (float_t *)malloc(((size_t)local_count * KNN + 1) * sizeof(float_t));
+    int *cross = (int *)malloc((local_count + 1) * sizeof(int));
+
+    int ncross = allKnnLocal(local_root, local_nbr, local_nbrd, cross);
+
+    // where the subtrees are, in units of KNN neighbours
+    int *counts = NULL, *displs = NULL, *ncrosses = NULL, *cdispls = NULL;
+    if (mpi_rank == 0)
+    {
+        counts = (int *)malloc(mpi_size * sizeof(int));
+        displs = (int *)malloc(mpi_size * sizeof(int));
+        ncrosses = (int *)malloc(mpi_size * sizeof(int));
+        cdispls = (int *)malloc(mpi_size * sizeof(int));
+    }
+    MPI_Gather(&local_count, 1, MPI_INT, counts, 1, MPI_INT, 0, comm);
+    MPI_Gather(&local_offset, 1, MPI_INT, displs, 1, MPI_INT, 0, comm);
+    MPI_Gather(&ncross, 1, MPI_INT, ncrosses, 1, MPI_INT, 0, comm);
+
+    MPI_Datatype MPI_nbr_t, MPI_nbrd_t;
+    MPI_Type_contiguous(KNN, MPI_INT, &MPI_nbr_t);
+    MPI_Type_contiguous(KNN, MPI_FLOAT_T, &MPI_nbrd_t);
+    MPI_Type_commit(&MPI_nbr_t);
+    MPI_Type_commit(&MPI_nbrd_t);
+
+    int *all_cross = NULL, total_cross = 0;
+    if (mpi_rank == 0)
+    {
+        *nbr = (int *)malloc((size_t)NPTS * KNN * sizeof(int));
+        *nbrd = (float_t *)malloc((size_t)NPTS * KNN * sizeof(float_t));
+
+        for (int r = 0; r < mpi_size; ++r)
+        {
+            cdispls[r] = total_cross;
+            total_cross += ncrosses[r];
+        }
+        all_cross = (int *)malloc((total_cross + 1) * sizeof(int));
+    }
+    MPI_Gatherv(local_nbr, local_count, MPI_nbr_t, *nbr, counts, displs, MPI_nbr_t, 0, comm);
+    MPI_Gatherv(local_nbrd, local_count, MPI_nbrd_t, *nbrd, counts, displs, MPI_nbrd_t, 0, comm);
+    MPI_Gatherv(cross, ncross, MPI_INT, all_cross, ncrosses, cdispls, MPI_INT, 0, comm);
+
+    if (mpi_rank == 0)
+    {
+        // points with a final answer already
+        char *done = (char *)calloc(NPTS, sizeof(char));
+        for (int r = 0; r < mpi_size; ++r)
+            memset(done + displs[r], 1, counts[r]);
+        for (int c = 0; c < total_cross; ++c)
+            done[all_cross[c]] = 0;
+
+        for (int i = 0; i < NPTS; ++i)
+        {
+            if (!done[i])
+                knnPoint(tree, 0, root, i, *nbr + (size_t)KNN * i, *nbrd + (size_t)KNN * i);
+        }
+
+        free(done);
+        free(all_cross);
+        free(cdispls);
+        free(ncrosses);
+        free(displs);
+        free(counts);
+    }
+
+    MPI_Type_free(&MPI_nbrd_t);
+    MPI_Type_free(&MPI_nbr_t);
+    free(cross);
+    free(local_nbrd);
+    free(local_nbr);
+}
+
+#ifndef NDEBUG
+void checkKnn(kdnode_t *tree, int *nbr, int mpi_rank)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Compares the distance of the farthest neighbour
+     * with a linear scan, on the first points
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+    if (mpi_rank == 0)
+    {
+        int wrong = 0;
+        for (int i = 0; i < NPTS && i < 1000; ++i)
+        {
+            int closer = 0;
+            double kd2 = dist2((tree + nbr[(size_t)KNN * i + KNN - 1])->split, (tree + i)->split);
+            for (int np = 0; np < NPTS; ++np)
+            {
+                if (np != i && dist2((tree + np)->split, (tree + i)->split) < kd2)
+                    ++closer;
+            }
+            if (closer > KNN - 1)
+                ++wrong;
+        }
+        printf("kNN check: %d wrong answers\n", wrong);
+    }
+}
+#endif
+#endif
+
 // ==================================================================
 //                          MAIN PROGRAM
 // ==================================================================
@@ -331,6 +612,32 @@ int main(int argc, char **argv)
         printf("Tree root is at node %d\n\n", root);
     }
 
+#ifdef KNN
+    // neighbours of every point, the root index is only right on rank 0
+    int *nbr = NULL;
+    float_t *nbrd = NULL;
+    MPI_Bcast(&root, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    time = MPI_Wtime();
+    allKnnParallel(tree, root, mpi_rank, mpi_size, &nbr, &nbrd, MPI_COMM_WORLD);
+    time = MPI_Wtime() - time;
+
+#ifndef NDEBUG
+    checkKnn(tree, nbr, mpi_rank);
+#endif
+
+    MPI_Reduce(&time, &avg_time, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (mpi_rank == 0)
+        printf("All-kNN computed in %lfs\n\n", avg_time / mpi_size);
+
+    free(nbrd);
+    free(nbr);
+
+    // rank 0 grew its subtree inside the full tree
+    if (mpi_rank != 0)
+        free(local_tree);
+#endif
+
     free(tree);
     MPI_Finalize();
     return 0;
@@ -25,12 +25,32 @@ function run {
     done
 }
 
+# NUMA mode (median builder only): one team per socket, threads
+# pinned within it, kept out of data/ so that the tables are not
+# affected
+function run_numa {
+    export OMP_NUM_THREADS=${1}
+    export OMP_PLACES=sockets
+    export OMP_PROC_BIND=spread,close
+    make clean
+    make USER_CFLAGS="-DNPTS=$2 -DNUMA"
+    mkdir -p numa_data
+    echo "" > numa_data/${1}_${2}
+    for j in {1..5}
+    do 
+        ./omp_kdtree >> numa_data/${1}_${2}
+        echo "" >> numa_data/${1}_${2}
+    done
+    unset OMP_PLACES OMP_PROC_BIND
+}
+
 #data for strong scaling
 # run 1 100000000
 # run 2 100000000
 # run 4 100000000
 # run 8 100000000
 # run 16 100000000
+# run_numa 24 100000000
 
 # data for weak scaling
 run 1 10000000
@@ -1,7 +1,12 @@
+#ifdef NUMA
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
 #include <time.h>
 #include <omp.h>
 
@@ -35,9 +40,178 @@
 typedef struct kdnode kdnode_t;
 struct kdnode {
     float_t split[NDIM];
+#ifdef BBOX
+    // tight bounding box of the subtree rooted here
+    float_t lo[NDIM], hi[NDIM];
+#endif
     int axis, left, right;
 };
 
+// a point in the sorted lists of the presorted builder
+typedef struct presorted presorted_t;
+struct presorted {
+    float_t split[NDIM];
+    int idx;
+};
+
+// available builders, selected on the command line
+typedef enum { MEDIAN, PRESORT, MORTON } engine_t;
+
+#ifdef NUMA
+typedef struct subtree subtree_t;
+struct subtree {
+    int start, end, axis, dom;
+    int *slot;
+#ifdef SPREAD
+    float_t box[2*NDIM];
+#endif
+};
+#endif
+
+// ==================================================================
+//                      NUMA placement
+// ==================================================================
+#ifdef NUMA
+// domains and threads of the nested layout, set by numaInit
+int ndomains = 1, nthreads = 1;
+
+void numaInit()
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * One domain per OpenMP place (run with
+     * OMP_PLACES=sockets), but never more domains
+     * than threads so OMP_NUM_THREADS is honoured
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    nthreads = omp_get_max_threads();
+    ndomains = omp_get_num_places();
+    if (ndomains < 1) ndomains = 1;
+    if (ndomains > nthreads) ndomains = nthreads;
+}
+
+int numaDomains()
+{
+    return ndomains;
+}
+
+int threadsPerDomain(int dom)
+{
+    // the remainder threads go to the first domains
+    return nthreads / ndomains + (dom < nthreads % ndomains);
+}
+
+int topLevels()
+{
+    // levels built before there is a subtree per domain
+    int levels = 0;
+    while ((1 << levels) < numaDomains()) ++levels;
+    return levels;
+}
+
+int leafDomain(int leaf)
+{
+    // subtrees are dealt to the domains left to right
+    return leaf * numaDomains() / (1 << topLevels());
+}
+
+int leafStart(int leaf)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Start of the range of a top level subtree. The
+     * medians are always at the middle of the range,
+     * so the top splits only depend on NPTS
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    int start = 0, end = NPTS;
+    for (int b = topLevels() - 1; b >= 0; --b)
+    {
+        if (end <= start) break;
+        int n = start + (end - start)/2;
+        if ((leaf >> b) & 1) start = n + 1;
+        else end = n;
+    }
+    return start < NPTS ? start : NPTS;
+}
+
+void domainRange(int dom, size_t *dstart, size_t *dend)
+{
+    // the subtrees of dom, with the medians before them
+    int nleaf = 1 << topLevels(), ndom = numaDomains();
+    int first = 0, next = nleaf;
+    while (leafDomain(first) < dom) ++first;
+    for (int l = first; l < nleaf; ++l)
+    {
+        if (leafDomain(l) > dom)
+        {
+            next = l;
+            break;
+        }
+    }
+    *dstart = dom ? leafStart(first) : 0;
+    *dend = dom < ndom - 1 ? leafStart(next) : NPTS;
+}
+
+void reportBinding()
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Prints where every thread of the nested
+     * domain/thread layout is pinned, using the
+     * same layout as the allocation and the build
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    int ndom = numaDomains();
+    printf("NUMA mode: %d domains, %d threads\n", ndom, nthreads);
+
+    #pragma omp parallel num_threads(ndom) proc_bind(spread)
+    {
+        int dom = omp_get_thread_num();
+
+        #pragma omp parallel num_threads(threadsPerDomain(dom)) proc_bind(close)
+        {
+            #pragma omp critical
+            printf("domain %2d | thread %3d | place %3d | cpu %3d\n",
+                   dom, omp_get_thread_num(), omp_get_place_num(), sched_getcpu());
+        }
+    }
+}
+#endif
+
+kdnode_t *allocNodes()
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Allocates the nodes array. In NUMA mode every
+     * domain first-touches the contiguous share of
+     * the array that its subtrees will be built on
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    kdnode_t *tree = (kdnode_t *)malloc(NPTS * sizeof(kdnode_t));
+    if (tree == NULL)
+    {
+        perror("Unable to allocate nodes! Exiting...\n");
+        exit(4);
+    }
+
+#ifdef NUMA
+    int ndom = numaDomains();
+
+    #pragma omp parallel num_threads(ndom) proc_bind(spread)
+    {
+        int dom = omp_get_thread_num();
+        size_t dstart, dend;
+        domainRange(dom, &dstart, &dend);
+
+        #pragma omp parallel num_threads(threadsPerDomain(dom)) proc_bind(close)
+        {
+            int t = omp_get_thread_num(), nt = omp_get_num_threads();
+            size_t start = dstart + (dend - dstart) * t / nt;
+            size_t end = dstart + (dend - dstart) * (t + 1) / nt;
+            memset(tree + start, 0, (end - start) * sizeof(kdnode_t));
+        }
+    }
+#endif
+    return tree;
+}
+
 // ==================================================================
 //                      User functions
 // ==================================================================
@@ -50,7 +224,7 @@ kdnode_t *parseFile()
      * * * * * * * * * * * * * * * * * * * * * * * * */
 
     // allocate nodes
-    kdnode_t *tree = (kdnode_t *)malloc(NPTS * sizeof(kdnode_t));
+    kdnode_t *tree = allocNodes();
 
     // open input file
     FILE *fp = fopen(DATA, "r");
@@ -91,7 +265,7 @@ kdnode_t *parseFile()
 
 kdnode_t *randomNodes()
 {
-    kdnode_t *tree = (kdnode_t*)malloc(NPTS*sizeof(kdnode_t));
+    kdnode_t *tree = allocNodes();
     #pragma omp parallel
     {
         int rank = omp_get_thread_num();
@@ -123,8 +297,16 @@ void printTree(kdnode_t *tree)
         {
             printf(PFMT, (tree + np)->split[nc]);
         }
-        printf(" | ax: %2d | children: %3d , %3d\n",
+        printf(" | ax: %2d | children: %3d , %3d",
                (tree + np)->axis, (tree + np)->left, (tree + np)->right);
+#ifdef BBOX
+        printf(" | box: ");
+        for (size_t nc = 0; nc < NDIM; ++nc)
+        {
+            printf(PFMT PFMT, (tree + np)->lo[nc], (tree + np)->hi[nc]);
+        }
+#endif
+        printf("\n");
     }
 }
 #endif
@@ -137,103 +319,1132 @@ inline void swap(kdnode_t *a, kdnode_t *b)
     memcpy(b->split, tmp, sizeof(tmp));
 }
 
+#ifdef SPREAD
+void boundingBox(kdnode_t *data, int start, int end, float_t *lo, float_t *hi)
+{
+    memcpy(lo, (data+start)->split, NDIM * sizeof(float_t));
+    memcpy(hi, (data+start)->split, NDIM * sizeof(float_t));
+
+    for (int p = start + 1; p < end; ++p)
+    {
+        for (int d = 0; d < NDIM; ++d)
+        {
+            if ((data+p)->split[d] < lo[d]) lo[d] = (data+p)->split[d];
+            if ((data+p)->split[d] > hi[d]) hi[d] = (data+p)->split[d];
+        }
+    }
+}
+
+int widestAxis(const float_t *lo, const float_t *hi)
+{
+    // split where the points are most spread out
+    int axis = 0;
+    for (int d = 1; d < NDIM; ++d)
+        if (hi[d] - lo[d] > hi[axis] - lo[axis]) axis = d;
+    return axis;
+}
+#endif
+
+#ifdef BBOX
+void mergeBox(kdnode_t *tree, int n)
+{
+    // the box is the node merged with the boxes of the children
+    memcpy((tree+n)->lo, (tree+n)->split, sizeof((tree+n)->lo));
+    memcpy((tree+n)->hi, (tree+n)->split, sizeof((tree+n)->hi));
+    int child[2] = {(tree+n)->left, (tree+n)->right};
+    for (int c = 0; c < 2; ++c)
+    {
+        if (child[c] < 0) continue;
+        for (int d = 0; d < NDIM; ++d)
+        {
+            if ((tree+child[c])->lo[d] < (tree+n)->lo[d]) (tree+n)->lo[d] = (tree+child[c])->lo[d];
+            if ((tree+child[c])->hi[d] > (tree+n)->hi[d]) (tree+n)->hi[d] = (tree+child[c])->hi[d];
+        }
+    }
+}
+#endif
+
 int find_median(kdnode_t *data, int start, int end, int axis)
 {
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Hoare style quickselect. Both scans stop on
+     * points equal to the pivot, so runs of equal
+     * coordinates are spread on both sides and at
+     * the end nothing left of md is greater and
+     * nothing right of it is smaller
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
     if (end <= start) return -1;
     if (end == start + 1) return start;
 
-    int p, store;
     int md = start + (end - start)/2;
-    double pivot;
+    int l = start, r = end - 1;
 
-    while(1)
+    while (l < r)
     {
-        // take median as pivot 
-        pivot = (data+md)->split[axis];
-
-        // swap median with end 
-        swap((data+md), (data+end-1));
+        // take median as pivot
+        float_t pivot = (data+md)->split[axis];
 
-        for (p = store = start; p < end; ++p)
+        int i = l, j = r;
+        do
         {
-            if ((data+p)->split[axis] < pivot)
-            {
-                if (p != store) swap((data+p), (data+store));
-                ++store;
-            }
-        }
-
-        swap((data+store), (data+end - 1));
+            while ((data+i)->split[axis] < pivot) ++i;
+            while (pivot < (data+j)->split[axis]) --j;
+            if (i <= j) swap((data+i++), (data+j--));
+        } while (i <= j);
 
-        if ((data+store)->split[axis] == (data+md)->split[axis])
-            return md;
-
-        if (store > md) end = store;
-        else start = store;
+        if (j < md) l = i;
+        if (md < i) r = j;
     }
+    return md;
 }
 
-int growTree(kdnode_t *tree, int start, int end, int axis)
+// below this size subtrees are grown inline by the task that reaches them
+#define TASK_CUTOFF 4096
+
+int growTree(kdnode_t *tree, int start, int end, int axis, const float_t *box)
 {
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * With SPREAD, box holds lo[NDIM] then hi[NDIM]
+     * bounding the range (NULL to scan for it): the
+     * children get it cut at the split plane, so
+     * only the first call scans the points
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
     // when len of input data is 0 return 0
     if (!(end-start)) return -1;
 
+#ifdef SPREAD
+    float_t scan[2*NDIM], lbox[2*NDIM], rbox[2*NDIM];
+    if (box == NULL)
+    {
+        boundingBox(tree, start, end, scan, scan + NDIM);
+        box = scan;
+    }
+    axis = widestAxis(box, box + NDIM);
+#endif
+
     // else do the recursive procedure
     int n;
     if ((n = find_median(tree, start, end, axis)) >= 0 ) 
     {
         (tree+n)->axis = axis;
+#ifdef SPREAD
+        memcpy(lbox, box, sizeof(lbox));
+        memcpy(rbox, box, sizeof(rbox));
+        lbox[NDIM + axis] = rbox[axis] = (tree+n)->split[axis];
+#else
         axis = (axis+1) % NDIM;
+#endif
 
-        #pragma omp task
+        #pragma omp task final(end - start <= TASK_CUTOFF)
         {
-            (tree+n)->left = growTree(tree, start, n, axis);
+#ifdef SPREAD
+            (tree+n)->left = growTree(tree, start, n, axis, lbox);
+#else
+            (tree+n)->left = growTree(tree, start, n, axis, NULL);
+#endif
         }
         
-        #pragma omp task
+        #pragma omp task final(end - start <= TASK_CUTOFF)
         {
-            (tree+n)->right = growTree(tree, n+1, end, axis);
+#ifdef SPREAD
+            (tree+n)->right = growTree(tree, n+1, end, axis, rbox);
+#else
+            (tree+n)->right = growTree(tree, n+1, end, axis, NULL);
+#endif
         }
+
+#ifdef BBOX
+        // boxes are merged bottom-up, no scan of the range
+        #pragma omp taskwait
+        mergeBox(tree, n);
+#endif
     }
     return n;
 }
 
-// ==================================================================
-//                      Main program
-// ==================================================================
-int main(int argc, char **argv)
+#ifdef NUMA
+void growTop(kdnode_t *tree, int start, int end, int axis, const float_t *box,
+             int levels, int leaf, int *slot, subtree_t *sub, int *nsub)
 {
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Builds the first levels of the tree and stores
+     * the remaining ranges in sub, left to right,
+     * with their domain and the slot where their root
+     * must be written. box is handled as in growTree
+     * * * * * * * * * * * * * * * * * * * * * * * * */
 
-    // either read file or generate data
-#ifdef DATA
-    kdnode_t *tree = parseFile();
+#ifdef SPREAD
+    float_t scan[2*NDIM], lbox[2*NDIM], rbox[2*NDIM];
+    if (box == NULL && end > start)
+    {
+        boundingBox(tree, start, end, scan, scan + NDIM);
+        box = scan;
+    }
+#endif
+
+    if (!levels)
+    {
+        sub[*nsub] = (subtree_t){start, end, axis, leafDomain(leaf), slot};
+#ifdef SPREAD
+        if (end > start) memcpy(sub[*nsub].box, box, sizeof(sub[*nsub].box));
+#endif
+        ++(*nsub);
+        return;
+    }
+
+#ifdef SPREAD
+    if (end > start) axis = widestAxis(box, box + NDIM);
+#endif
+
+    int n;
+    if ((*slot = n = find_median(tree, start, end, axis)) >= 0)
+    {
+        (tree+n)->axis = axis;
+#ifdef SPREAD
+        memcpy(lbox, box, sizeof(lbox));
+        memcpy(rbox, box, sizeof(rbox));
+        lbox[NDIM + axis] = rbox[axis] = (tree+n)->split[axis];
+        growTop(tree, start, n, axis, lbox, levels-1, 2*leaf, &(tree+n)->left, sub, nsub);
+        growTop(tree, n+1, end, axis, rbox, levels-1, 2*leaf + 1, &(tree+n)->right, sub, nsub);
 #else
-    kdnode_t *tree = randomNodes();
+        axis = (axis+1) % NDIM;
+        growTop(tree, start, n, axis, NULL, levels-1, 2*leaf, &(tree+n)->left, sub, nsub);
+        growTop(tree, n+1, end, axis, NULL, levels-1, 2*leaf + 1, &(tree+n)->right, sub, nsub);
 #endif
+    }
+}
 
-    int root;
-    double time = omp_get_wtime();
+#ifdef BBOX
+void topBoxes(kdnode_t *tree, int node, int levels)
+{
+    // boxes of the nodes built by growTop, once the subtrees are done
+    if (node < 0 || !levels) return;
+    topBoxes(tree, (tree+node)->left, levels-1);
+    topBoxes(tree, (tree+node)->right, levels-1);
+    mergeBox(tree, node);
+}
+#endif
 
-    // build tree
-    #pragma omp parallel
+int growTreeNuma(kdnode_t *tree)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Splits the tree until there is a subtree per
+     * domain, then each domain grows its subtrees
+     * with a team of threads pinned to its socket
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    int ndom = numaDomains();
+    int levels = topLevels();
+
+    int root, nsub = 0;
+    subtree_t *sub = (subtree_t *)malloc((1 << levels) * sizeof(subtree_t));
+    growTop(tree, 0, NPTS, 0, NULL, levels, 0, &root, sub, &nsub);
+
+    #pragma omp parallel num_threads(ndom) proc_bind(spread)
     {
-        #pragma omp single
+        int dom = omp_get_thread_num();
+
+        #pragma omp parallel num_threads(threadsPerDomain(dom)) proc_bind(close)
         {
-            root = growTree(tree, 0, NPTS, 0);
+            #pragma omp single
+            {
+                for (int s = 0; s < nsub; ++s)
+                {
+                    if (sub[s].dom != dom) continue;
+
+                    #pragma omp task
+                    {
+#ifdef SPREAD
+                        *sub[s].slot = growTree(tree, sub[s].start, sub[s].end, sub[s].axis, sub[s].box);
+#else
+                        *sub[s].slot = growTree(tree, sub[s].start, sub[s].end, sub[s].axis, NULL);
+#endif
+                    }
+                }
+            }
         }
     }
 
-    time = omp_get_wtime() - time;
+#ifdef BBOX
+    topBoxes(tree, root, levels);
+#endif
 
-#ifndef NDEBUG
-    // print for debugging
-    printTree(tree);
-    printf("\n\n");
+    free(sub);
+    return root;
+}
 #endif
 
-    // print results
-    printf("Tree grown in %lfs\n", time);
-    printf("Tree root is at node %d\n", root);
+// ==================================================================
+//                      Morton builder
+// ==================================================================
+#define MORTON_BITS (64/NDIM < 32 ? 64/NDIM : 32)
+#define MORTON_CUTOFF (1 << 16)
+#define RADIX_BITS 11
+#define RADIX (1 << RADIX_BITS)
+
+int mortonBits(int n)
+{
+    // a few bits per axis more than needed to tell n points apart
+    int lg = 0;
+    while ((1L << lg) < n) ++lg;
+
+    int bits = (lg + NDIM - 1) / NDIM + 2;
+    return bits < MORTON_BITS ? bits : MORTON_BITS;
+}
+
+void mortonCodes(kdnode_t *tree, uint64_t *code, int n)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Quantises every coordinate on mortonBits bits
+     * inside the bounding box of the data and
+     * interleaves them, axis 0 in the highest bit
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    if (n <= 0) return;
+
+    float_t lo[NDIM], hi[NDIM];
+    double scale[NDIM];
+    for (int d = 0; d < NDIM; ++d)
+    {
+        lo[d] = hi[d] = tree->split[d];
+    }
+
+    #pragma omp parallel for reduction(min:lo[:NDIM]) reduction(max:hi[:NDIM])
+    for (int i = 0; i < n; ++i)
+    {
+        for (int d = 0; d < NDIM; ++d)
+        {
+            if ((tree+i)->split[d] < lo[d]) lo[d] = (tree+i)->split[d];
+            if ((tree+i)->split[d] > hi[d]) hi[d] = (tree+i)->split[d];
+        }
+    }
+
+    int bits = mortonBits(n);
+    uint64_t qmax = (UINT64_C(1) << bits) - 1;
+    for (int d = 0; d < NDIM; ++d)
+        scale[d] = hi[d] > lo[d] ? qmax / ((double)hi[d] - lo[d]) : 0.0;
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; ++i)
+    {
+        uint64_t q[NDIM], c = 0;
+        for (int d = 0; d < NDIM; ++d)
+        {
+            q[d] = (uint64_t)(((tree+i)->split[d] - lo[d]) * scale[d]);
+            if (q[d] > qmax) q[d] = qmax;
+        }
+        for (int b = bits - 1; b >= 0; --b)
+        {
+            for (int d = 0; d < NDIM; ++d)
+                c = (c << 1) | ((q[d] >> b) & 1);
+        }
+        code[i] = c;
+    }
+}
+
+void radixSort(uint64_t **code, int **idx, uint64_t **code_tmp, int **idx_tmp, int n, int nbits)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Stable LSD radix sort of the nbits low bits of
+     * the codes, carrying the point indices along.
+     * Every thread counts and scatters its own
+     * contiguous chunk, digits shared by all the
+     * codes are skipped
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    int (*hist)[RADIX] = malloc(omp_get_max_threads() * sizeof(*hist));
+    int skip;
+
+    #pragma omp parallel
+    {
+        int t = omp_get_thread_num(), nt = omp_get_num_threads();
+        int start = (long)n * t / nt, end = (long)n * (t + 1) / nt;
+
+        for (int shift = 0; shift < nbits; shift += RADIX_BITS)
+        {
+            memset(hist[t], 0, sizeof(*hist));
+            for (int i = start; i < end; ++i)
+                ++hist[t][((*code)[i] >> shift) & (RADIX - 1)];
+
+            #pragma omp barrier
+
+            // turn the counts into per-thread output offsets
+            #pragma omp single
+            {
+                int sum = 0;
+                skip = 0;
+                for (int b = 0; b < RADIX; ++b)
+                {
+                    int first = sum;
+                    for (int tt = 0; tt < nt; ++tt)
+                    {
+                        int c = hist[tt][b];
+                        hist[tt][b] = sum;
+                        sum += c;
+                    }
+                    if (sum - first == n) skip = 1;
+                }
+            }
+
+            if (skip) continue;
+
+            for (int i = start; i < end; ++i)
+            {
+                int o = hist[t][((*code)[i] >> shift) & (RADIX - 1)]++;
+                (*code_tmp)[o] = (*code)[i];
+                (*idx_tmp)[o] = (*idx)[i];
+            }
+
+            #pragma omp barrier
+
+            #pragma omp single
+            {
+                uint64_t *c = *code; *code = *code_tmp; *code_tmp = c;
+                int *x = *idx; *idx = *idx_tmp; *idx_tmp = x;
+            }
+        }
+    }
+
+    free(hist);
+}
+
+int argminOnAxis(kdnode_t *tree, int start, int end, int axis)
+{
+    // leftmost smallest point on axis, large ranges split in tasks
+    if (end - start <= MORTON_CUTOFF)
+    {
+        int m = start;
+        for (int i = start + 1; i < end; ++i)
+            if ((tree+i)->split[axis] < (tree+m)->split[axis]) m = i;
+        return m;
+    }
+
+    int md = start + (end - start)/2, ml, mr;
+
+    #pragma omp task shared(ml)
+    ml = argminOnAxis(tree, start, md, axis);
+
+    #pragma omp task shared(mr)
+    mr = argminOnAxis(tree, md, end, axis);
+
+    #pragma omp taskwait
+    return (tree+mr)->split[axis] < (tree+ml)->split[axis] ? mr : ml;
+}
+
+void parallelCopy(char *dst, const char *src, size_t bytes)
+{
+    // non overlapping copy, large blocks split in tasks
+    if (bytes <= MORTON_CUTOFF * sizeof(kdnode_t))
+    {
+        memcpy(dst, src, bytes);
+        return;
+    }
+
+    size_t half = bytes / 2;
+
+    #pragma omp task
+    parallelCopy(dst, src, half);
+
+    #pragma omp task
+    parallelCopy(dst + half, src + half, bytes - half);
+
+    #pragma omp taskwait
+}
+
+int growTreeMorton(kdnode_t *tree, uint64_t *code, kdnode_t *scratch, uint64_t *scode,
+                   int start, int end, int axis)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * The range is sorted by code: the highest bit
+     * where its codes differ gives the split axis and
+     * the point where the right half starts. The point
+     * of the right half closest to the plane becomes
+     * the node, the rest is shifted through the
+     * scratch buffers to stay in Morton order
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    if (!(end-start)) return -1;
+
+    // no bits left to split on, duplicates in the grid
+    if (code[start] == code[end-1])
+        return growTree(tree, start, end, axis, NULL);
+
+    int bit = 63 - __builtin_clzll(code[start] ^ code[end-1]);
+    uint64_t mask = UINT64_C(1) << bit;
+    axis = NDIM - 1 - bit % NDIM;
+
+    // first code with the bit set
+    int lo = start, hi = end - 1;
+    while (lo < hi)
+    {
+        int md = lo + (hi - lo)/2;
+        if (code[md] & mask) hi = md;
+        else lo = md + 1;
+    }
+    int n = lo;
+
+    // move the smallest point of the right half in front of it
+    int m = argminOnAxis(tree, n, end, axis);
+
+    if (m != n)
+    {
+        kdnode_t node = *(tree+m);
+        uint64_t c = code[m];
+        if (m - n <= MORTON_CUTOFF)
+        {
+            memmove(tree + n + 1, tree + n, (m - n) * sizeof(kdnode_t));
+            memmove(code + n + 1, code + n, (m - n) * sizeof(uint64_t));
+        }
+        else
+        {
+            parallelCopy((char *)(scratch + n), (char *)(tree + n), (m - n) * sizeof(kdnode_t));
+            parallelCopy((char *)(scode + n), (char *)(code + n), (m - n) * sizeof(uint64_t));
+            parallelCopy((char *)(tree + n + 1), (char *)(scratch + n), (m - n) * sizeof(kdnode_t));
+            parallelCopy((char *)(code + n + 1), (char *)(scode + n), (m - n) * sizeof(uint64_t));
+        }
+        *(tree+n) = node;
+        code[n] = c;
+    }
+
+    (tree+n)->axis = axis;
+#ifndef SPREAD
+    axis = (axis+1) % NDIM;
+#endif
+
+    #pragma omp task final(end - start <= TASK_CUTOFF)
+    {
+        (tree+n)->left = growTreeMorton(tree, code, scratch, scode, start, n, axis);
+    }
+
+    #pragma omp task final(end - start <= TASK_CUTOFF)
+    {
+        (tree+n)->right = growTreeMorton(tree, code, scratch, scode, n+1, end, axis);
+    }
+
+#ifdef BBOX
+    #pragma omp taskwait
+    mergeBox(tree, n);
+#endif
+    return n;
+}
+
+int growTreeMortonOrder(kdnode_t *tree)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Sorts the points along the Morton curve and
+     * derives the splits from the sorted codes, the
+     * tree is stored in place of the input
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    int root;
+    uint64_t *code = (uint64_t *)malloc(NPTS * sizeof(uint64_t));
+    uint64_t *code_tmp = (uint64_t *)malloc(NPTS * sizeof(uint64_t));
+    int *idx = (int *)malloc(NPTS * sizeof(int));
+    int *idx_tmp = (int *)malloc(NPTS * sizeof(int));
+    kdnode_t *pts = (kdnode_t *)malloc(NPTS * sizeof(kdnode_t));
+
+    if (code == NULL || code_tmp == NULL || idx == NULL || idx_tmp == NULL || pts == NULL)
+    {
+        perror("Unable to allocate Morton buffers! Exiting...\n");
+        exit(4);
+    }
+
+    mortonCodes(tree, code, NPTS);
+
+    #pragma omp parallel for
+    for (int i = 0; i < NPTS; ++i)
+    {
+        idx[i] = i;
+        *(pts+i) = *(tree+i);
+    }
+
+    radixSort(&code, &idx, &code_tmp, &idx_tmp, NPTS, NDIM * mortonBits(NPTS));
+
+    // store the points in curve order
+    #pragma omp parallel for
+    for (int i = 0; i < NPTS; ++i)
+        *(tree+i) = *(pts+idx[i]);
+
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            // pts and code_tmp are free now, reused as scratch
+            root = growTreeMorton(tree, code, pts, code_tmp, 0, NPTS, 0);
+        }
+    }
+
+    free(pts);
+    free(idx_tmp);
+    free(idx);
+    free(code_tmp);
+    free(code);
+    return root;
+}
+
+// ==================================================================
+//                      Presorted builder
+// ==================================================================
+static inline uint64_t sortKey(float_t v)
+{
+    // order preserving map to an unsigned key, -0 and +0 collapse
+    if (v == 0) v = 0;
+#ifdef DOUBLE_PRECISION
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    return u >> 63 ? ~u : u | (UINT64_C(1) << 63);
+#else
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    return u >> 31 ? ~u : u | (UINT32_C(1) << 31);
+#endif
+}
+
+int growTreePresorted(kdnode_t *tree, presorted_t **list, int cur,
+                      int start, int end, int axis)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * list[2*d + side] are the two buffers of axis d,
+     * bit d of cur tells which one holds the points
+     * of the range sorted along d. The median is read
+     * directly on the split axis and the other lists
+     * are stably split into their spare buffer
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    if (!(end-start)) return -1;
+
+#if defined(SPREAD) || defined(BBOX)
+    // the extremes on every axis are the ends of its list
+    float_t lo[NDIM], hi[NDIM];
+    for (int d = 0; d < NDIM; ++d)
+    {
+        presorted_t *l = list[2*d + ((cur >> d) & 1)];
+        lo[d] = l[start].split[d];
+        hi[d] = l[end-1].split[d];
+    }
+#endif
+#ifdef SPREAD
+    axis = widestAxis(lo, hi);
+#endif
+
+    int n = start + (end - start)/2;
+    presorted_t p = list[2*axis + ((cur >> axis) & 1)][n];
+    float_t pv = p.split[axis];
+
+    for (int d = 0; d < NDIM; ++d)
+    {
+        if (d == axis) continue;
+
+        // points before the median in the order of the split axis go left
+        presorted_t *src = list[2*d + ((cur >> d) & 1)];
+        presorted_t *dst = list[2*d + !((cur >> d) & 1)];
+        // branch free, the median itself lands in the unused slot n
+        int l = start, r = n + 1;
+        for (int i = start; i < end; ++i)
+        {
+            float_t v = src[i].split[axis];
+            int goleft = v < pv || (v == pv && src[i].idx < p.idx);
+            int goright = !goleft && src[i].idx != p.idx;
+            dst[goleft ? l : (goright ? r : n)] = src[i];
+            l += goleft;
+            r += goright;
+        }
+        cur ^= 1 << d;
+    }
+
+    memcpy((tree+n)->split, p.split, sizeof((tree+n)->split));
+    (tree+n)->axis = axis;
+#ifdef BBOX
+    memcpy((tree+n)->lo, lo, sizeof(lo));
+    memcpy((tree+n)->hi, hi, sizeof(hi));
+#endif
+#ifndef SPREAD
+    axis = (axis+1) % NDIM;
+#endif
+
+    #pragma omp task
+    {
+        (tree+n)->left = growTreePresorted(tree, list, cur, start, n, axis);
+    }
+
+    #pragma omp task
+    {
+        (tree+n)->right = growTreePresorted(tree, list, cur, n+1, end, axis);
+    }
+    return n;
+}
+
+int growTreePresort(kdnode_t *tree)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Radix sorts every axis once and then builds the
+     * tree in place of the input, with the same layout
+     * as growTree (median of [start,end) at the middle)
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    int root;
+    presorted_t *list[2*NDIM];
+    for (int l = 0; l < 2*NDIM; ++l)
+    {
+        list[l] = (presorted_t *)malloc(NPTS * sizeof(presorted_t));
+        if (list[l] == NULL)
+        {
+            perror("Unable to allocate presort buffers! Exiting...\n");
+            exit(4);
+        }
+    }
+
+    uint64_t *key = (uint64_t *)malloc(NPTS * sizeof(uint64_t));
+    uint64_t *key_tmp = (uint64_t *)malloc(NPTS * sizeof(uint64_t));
+    int *idx = (int *)malloc(NPTS * sizeof(int));
+    int *idx_tmp = (int *)malloc(NPTS * sizeof(int));
+    if (key == NULL || key_tmp == NULL || idx == NULL || idx_tmp == NULL)
+    {
+        perror("Unable to allocate presort buffers! Exiting...\n");
+        exit(4);
+    }
+
+    for (int d = 0; d < NDIM; ++d)
+    {
+        // ties keep the index order, the sort is stable
+        #pragma omp parallel for
+        for (int i = 0; i < NPTS; ++i)
+        {
+            key[i] = sortKey((tree+i)->split[d]);
+            idx[i] = i;
+        }
+
+        radixSort(&key, &idx, &key_tmp, &idx_tmp, NPTS, 8 * sizeof(float_t));
+
+        #pragma omp parallel for
+        for (int i = 0; i < NPTS; ++i)
+        {
+            memcpy(list[2*d][i].split, (tree+idx[i])->split, sizeof(list[2*d][i].split));
+            list[2*d][i].idx = idx[i];
+        }
+    }
+
+    free(idx_tmp);
+    free(idx);
+    free(key_tmp);
+    free(key);
+
+    #pragma omp parallel
+    {
+        #pragma omp single
+        {
+            root = growTreePresorted(tree, list, 0, 0, NPTS, 0);
+        }
+    }
+
+    for (int l = 0; l < 2*NDIM; ++l)
+        free(list[l]);
+    return root;
+}
+
+// ==================================================================
+//                      Queries
+// ==================================================================
+#define QUERY_TILE 256
+
+static inline double dist2(const float_t *a, const float_t *b)
+{
+    double d2 = 0.0;
+    for (int d = 0; d < NDIM; ++d)
+        d2 += ((double)a[d] - b[d]) * ((double)a[d] - b[d]);
+    return d2;
+}
+
+#ifdef BBOX
+static inline double boxDist2(kdnode_t *node, const float_t *q)
+{
+    // distance from q to the bounding box of the subtree
+    double d2 = 0.0;
+    for (int d = 0; d < NDIM; ++d)
+    {
+        double o = q[d] < node->lo[d] ? (double)node->lo[d] - q[d]
+                 : q[d] > node->hi[d] ? (double)q[d] - node->hi[d] : 0.0;
+        d2 += o * o;
+    }
+    return d2;
+}
+#endif
+
+void nearest(kdnode_t *tree, int node, const float_t *q, int *best, double *bestd2)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Nearest neighbour search, best and bestd2 hold
+     * the current candidate and are only improved
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    if (node < 0) return;
+
+    kdnode_t *nd = tree + node;
+#ifdef BBOX
+    if (boxDist2(nd, q) >= *bestd2) return;
+#endif
+
+    double d2 = dist2(nd->split, q);
+    if (d2 < *bestd2)
+    {
+        *bestd2 = d2;
+        *best = node;
+    }
+
+    // visit the side of q first, the other only if it can be closer
+    double diff = (double)q[nd->axis] - nd->split[nd->axis];
+    nearest(tree, diff < 0 ? nd->left : nd->right, q, best, bestd2);
+    if (diff * diff < *bestd2)
+        nearest(tree, diff < 0 ? nd->right : nd->left, q, best, bestd2);
+}
+
+void queryBatch(kdnode_t *tree, int root, kdnode_t *queries, int nq, int *result)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Answers nq nearest neighbour queries. Queries
+     * are visited in Morton order in tiles, so that
+     * consecutive searches walk the same paths of
+     * the tree, and the answers are written back in
+     * the original order
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    if (nq <= 0) return;
+
+    // nothing to find in an empty tree
+    if (root < 0)
+    {
+        for (int i = 0; i < nq; ++i)
+            result[i] = -1;
+        return;
+    }
+
+    uint64_t *code = (uint64_t *)malloc(nq * sizeof(uint64_t));
+    uint64_t *code_tmp = (uint64_t *)malloc(nq * sizeof(uint64_t));
+    int *order = (int *)malloc(nq * sizeof(int));
+    int *order_tmp = (int *)malloc(nq * sizeof(int));
+
+    if (code == NULL || code_tmp == NULL || order == NULL || order_tmp == NULL)
+    {
+        perror("Unable to allocate query buffers! Exiting...\n");
+        exit(4);
+    }
+
+    mortonCodes(queries, code, nq);
+
+    #pragma omp parallel for
+    for (int i = 0; i < nq; ++i)
+        order[i] = i;
+
+    radixSort(&code, &order, &code_tmp, &order_tmp, nq, NDIM * mortonBits(nq));
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < nq; tile += QUERY_TILE)
+    {
+        int end = tile + QUERY_TILE < nq ? tile + QUERY_TILE : nq;
+
+        for (int i = tile; i < end; ++i)
+        {
+            int best = -1;
+            double bestd2 = INFINITY;
+            nearest(tree, root, (queries + order[i])->split, &best, &bestd2);
+            result[order[i]] = best;
+        }
+    }
+
+    free(order_tmp);
+    free(order);
+    free(code_tmp);
+    free(code);
+}
+
+// ==================================================================
+//                      All-points kNN
+// ==================================================================
+#ifdef KNN
+// a point is not its own neighbour, there are at most NPTS-1
+#if KNN >= NPTS
+#error "KNN must be smaller than NPTS"
+#endif
+
+static inline void heapSift(int *hidx, double *hd2, int k)
+{
+    // restores the max-heap after the top has been replaced
+    int i = 0;
+    while (1)
+    {
+        int c = 2*i + 1;
+        if (c >= k) break;
+        if (c + 1 < k && hd2[c+1] > hd2[c]) ++c;
+        if (hd2[c] <= hd2[i]) break;
+
+        int ti = hidx[i]; hidx[i] = hidx[c]; hidx[c] = ti;
+        double td = hd2[i]; hd2[i] = hd2[c]; hd2[c] = td;
+        i = c;
+    }
+}
+
+static inline void heapOffer(int *hidx, double *hd2, int k, int node, double d2)
+{
+    // every node is offered once per search, no duplicates to check
+    if (d2 >= hd2[0]) return;
+
+    hidx[0] = node;
+    hd2[0] = d2;
+    heapSift(hidx, hd2, k);
+}
+
+void knnSearch(kdnode_t *tree, int node, int self, int *hidx, double *hd2)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * k nearest neighbours of point self, the max-heap
+     * hidx/hd2 holds the candidates and its top is
+     * the current pruning radius
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    if (node < 0) return;
+
+    kdnode_t *nd = tree + node;
+    const float_t *q = (tree + self)->split;
+#ifdef BBOX
+    if (boxDist2(nd, q) >= hd2[0]) return;
+#endif
+
+    if (node != self)
+        heapOffer(hidx, hd2, KNN, node, dist2(nd->split, q));
+
+    double diff = (double)q[nd->axis] - nd->split[nd->axis];
+    knnSearch(tree, diff < 0 ? nd->left : nd->right, self, hidx, hd2);
+    if (diff * diff < hd2[0])
+        knnSearch(tree, diff < 0 ? nd->right : nd->left, self, hidx, hd2);
+}
+
+void allKnn(kdnode_t *tree, int root, int *nbr, float_t *nbrd)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * KNN nearest neighbours of every point, stored
+     * by increasing distance in nbr/nbrd[KNN*i].
+     * Points are visited in tiles in array order,
+     * which the builders leave spatially coherent,
+     * so neighbouring searches walk the same nodes
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < NPTS; tile += QUERY_TILE)
+    {
+        int end = tile + QUERY_TILE < NPTS ? tile + QUERY_TILE : NPTS;
+        int hidx[KNN];
+        double hd2[KNN];
+
+        for (int i = tile; i < end; ++i)
+        {
+            for (int j = 0; j < KNN; ++j)
+            {
+                hidx[j] = -1;
+                hd2[j] = INFINITY;
+            }
+
+            knnSearch(tree, root, i, hidx, hd2);
+
+            // empty the heap from the farthest
+            for (int j = KNN - 1; j >= 0; --j)
+            {
+                nbr[(size_t)KNN*i + j] = hidx[0];
+                nbrd[(size_t)KNN*i + j] = sqrt(hd2[0]);
+                hidx[0] = -1;
+                hd2[0] = -1.0;
+                heapSift(hidx, hd2, KNN);
+            }
+        }
+    }
+}
+
+#ifndef NDEBUG
+void checkKnn(kdnode_t *tree, int *nbr)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Compares the distance of the farthest neighbour
+     * with a linear scan, on the first points
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    int wrong = 0;
+    for (int i = 0; i < NPTS && i < 1000; ++i)
+    {
+        int closer = 0;
+        double kd2 = dist2((tree + nbr[(size_t)KNN*i + KNN-1])->split, (tree + i)->split);
+        for (int np = 0; np < NPTS; ++np)
+        {
+            if (np != i && dist2((tree + np)->split, (tree + i)->split) < kd2)
+                ++closer;
+        }
+        if (closer > KNN - 1) ++wrong;
+    }
+    printf("kNN check: %d wrong answers\n", wrong);
+}
+#endif
+#endif
+
+#ifdef NQUERIES
+kdnode_t *randomQueries()
+{
+    // uniform queries in the range of randomNodes
+    kdnode_t *queries = (kdnode_t *)malloc(NQUERIES * sizeof(kdnode_t));
+
+    #pragma omp parallel
+    {
+        int rank = omp_get_thread_num();
+        srand(rank*100 + 1);
+
+        #pragma omp for
+        for (int i = 0; i < NQUERIES; ++i)
+        {
+            for (int j = 0; j < NDIM; ++j)
+            {
+                (queries+i)->split[j] = rand()/((double)RAND_MAX)*100;
+            }
+        }
+    }
+    return queries;
+}
+
+#ifndef NDEBUG
+void checkQueries(kdnode_t *tree, kdnode_t *queries, int *result)
+{
+    /* * * * * * * * * * * * * * * * * * * * * * * * *
+     * Compares the answers with a linear scan
+     * * * * * * * * * * * * * * * * * * * * * * * * */
+
+    int wrong = 0;
+    for (int i = 0; i < NQUERIES; ++i)
+    {
+        double bestd2 = dist2((tree + result[i])->split, (queries + i)->split);
+        for (int np = 0; np < NPTS; ++np)
+        {
+            if (dist2((tree + np)->split, (queries + i)->split) < bestd2)
+            {
+                ++wrong;
+                break;
+            }
+        }
+    }
+    printf("Query check: %d wrong answers\n", wrong);
+}
+#endif
+#endif
+
+// ==================================================================
+//                      Main program
+// ==================================================================
+int main(int argc, char **argv)
+{
+    // select the builder, defaults to the median one
+    engine_t engine = MEDIAN;
+    if (argc > 1 && !strcmp(argv[1], "presort"))
+        engine = PRESORT;
+    else if (argc > 1 && !strcmp(argv[1], "morton"))
+        engine = MORTON;
+    else if (argc > 1 && strcmp(argv[1], "median"))
+    {
+        fprintf(stderr, "Usage: %s [median|presort|morton]\n", argv[0]);
+#ifdef NUMA
+        fprintf(stderr, "NUMA placement only applies to the median builder\n");
+#endif
+        exit(5);
+    }
+
+#ifdef NUMA
+    // nested teams: one per domain, then threads within it
+    numaInit();
+    omp_set_max_active_levels(2);
+    reportBinding();
+    if (engine != MEDIAN)
+        printf("NUMA placement only applies to the median builder\n");
+#endif
+
+    // either read file or generate data
+#ifdef DATA
+    kdnode_t *tree = parseFile();
+#else
+    kdnode_t *tree = randomNodes();
+#endif
+
+    int root;
+    double time = omp_get_wtime();
+
+    // build tree
+    if (engine == PRESORT)
+    {
+        root = growTreePresort(tree);
+    }
+    else if (engine == MORTON)
+    {
+        root = growTreeMortonOrder(tree);
+    }
+    else
+    {
+#ifdef NUMA
+        root = growTreeNuma(tree);
+#else
+        #pragma omp parallel
+        {
+            #pragma omp single
+            {
+                root = growTree(tree, 0, NPTS, 0, NULL);
+            }
+        }
+#endif
+    }
+
+    time = omp_get_wtime() - time;
+
+#ifndef NDEBUG
+    // print for debugging
+    printTree(tree);
+    printf("\n\n");
+#endif
+
+    // print results
+    printf("Tree grown in %lfs\n", time);
+    printf("Tree root is at node %d\n", root);
+
+#ifdef NQUERIES
+    // answer a batch of random queries
+    kdnode_t *queries = randomQueries();
+    int *result = (int *)malloc(NQUERIES * sizeof(int));
+
+    time = omp_get_wtime();
+    queryBatch(tree, root, queries, NQUERIES, result);
+    time = omp_get_wtime() - time;
+
+#ifndef NDEBUG
+    checkQueries(tree, queries, result);
+#endif
+
+    printf("Queries answered in %lfs\n", time);
+
+    free(result);
+    free(queries);
+#endif
+
+#ifdef KNN
+    // neighbours of every point of the tree
+    int *nbr = (int *)malloc((size_t)NPTS * KNN * sizeof(int));
+    float_t *nbrd = (float_t *)malloc((size_t)NPTS * KNN * sizeof(float_t));
+
+    time = omp_get_wtime();
+    allKnn(tree, root, nbr, nbrd);
+    time = omp_get_wtime() - time;
+
+#ifndef NDEBUG
+    checkKnn(tree, nbr);
+#endif
+
+    printf("All-kNN computed in %lfs\n", time);
+
+    free(nbrd);
+    free(nbr);
+#endif
 
     free(tree);
     return 0;